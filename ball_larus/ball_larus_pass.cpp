@@ -5,6 +5,8 @@
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include <vector>
 #include <unordered_set>
 #include <queue>
@@ -29,10 +31,50 @@ FunctionCallee getIncrementPathCountFunction(Module& M) {
     Type *Int64Ty = Type::getInt64Ty(Context);
     Type *CharPtrTy = PointerType::get(Type::getInt8Ty(Context), 0);
 
-    FunctionType *FuncTy = FunctionType::get(VoidTy, {CharPtrTy, Int64Ty}, false);
+    FunctionType *FuncTy = FunctionType::get(VoidTy, {CharPtrTy, Int64Ty, Int64Ty, Int64Ty}, false);
     return M.getOrInsertFunction("__increment_path_count", FuncTy);
 }
 
+FunctionCallee getFlushPathBufferFunction(Module& M) {
+    LLVMContext &Context = M.getContext();
+    Type *VoidTy = Type::getVoidTy(Context);
+    Type *Int64Ty = Type::getInt64Ty(Context);
+    Type *CharPtrTy = PointerType::get(Type::getInt8Ty(Context), 0);
+    Type *Int64PtrTy = PointerType::get(Int64Ty, 0);
+
+    FunctionType *FuncTy = FunctionType::get(VoidTy, {CharPtrTy, Int64PtrTy, Int64Ty, Int64Ty, Int64Ty}, false);
+    return M.getOrInsertFunction("__flush_path_buffer", FuncTy);
+}
+
+FunctionCallee getRegisterPathBufferFunction(Module& M) {
+    LLVMContext &Context = M.getContext();
+    Type *VoidTy = Type::getVoidTy(Context);
+    Type *Int64Ty = Type::getInt64Ty(Context);
+    Type *Int64PtrTy = PointerType::get(Int64Ty, 0);
+    Type *CharPtrTy = PointerType::get(Type::getInt8Ty(Context), 0);
+
+    FunctionType *FuncTy = FunctionType::get(VoidTy, {CharPtrTy, Int64PtrTy, Int64PtrTy, Int64Ty, Int64Ty}, false);
+    return M.getOrInsertFunction("__register_path_buffer", FuncTy);
+}
+
+// Hot path threshold of the runtime, 0 while online hot path detection is off
+GlobalVariable* getHotPathThreshold(Module& M) {
+    return cast<GlobalVariable>(M.getOrInsertGlobal("__hot_path_threshold", Type::getInt64Ty(M.getContext())));
+}
+
+// Options parsed from the pipeline text, e.g. "ball-larus<batch>" or "ball-larus<batch=128>"
+struct BallLarusOptions {
+    // Record finished paths in a per-function buffer instead of calling the runtime each time
+    bool batch = false;
+    uint64_t batchSize = 256;
+    // Width of the runtime counters of functions with at least counterMinPaths paths,
+    // smaller path spaces always use 64-bit counters
+    uint64_t counterBits = 64;
+    uint64_t counterMinPaths = 1 << 16;
+    // Narrow counters stop at their maximum instead of spilling into a 64-bit counter
+    bool saturate = false;
+};
+
 
 // Graph Processing
 struct BackEdge {
@@ -56,7 +98,7 @@ struct Node {
 // Contains info about both DAG and CFG
 class Graph {
 public:
-    Graph(Function& F) {
+    Graph(Function& F, BallLarusOptions const& opts) : opts(opts) {
         // Generate CFG and get entry/exit
         uint64_t bbNum = 0;
         std::unordered_map<BasicBlock*, uint64_t> bbId;
@@ -156,8 +198,6 @@ public:
     */
     void instrument(Function& F) {
         Module *M = F.getParent();
-        auto IncrementPathCountFunc = getIncrementPathCountFunction(*M);
-
         LLVMContext &Context = F.getContext();
         Type *Int64Ty = Type::getInt64Ty(Context);
         IRBuilder<> Builder(Context);
@@ -183,6 +223,11 @@ public:
             true
         );
 
+        if (opts.batch) {
+            createPathBuffer(F);
+            funcName = FuncName;
+        }
+
         // Create path register alloca in entry block
         Builder.SetInsertPoint(&F.getEntryBlock().front());
         AllocaInst *PathRegister = Builder.CreateAlloca(Int64Ty, nullptr, "path_register");
@@ -244,8 +289,7 @@ public:
             Value* currentPath = Builder.CreateLoad(Int64Ty, PathRegister);
             Value *incrementedPath = Builder.CreateAdd(currentPath, ConstantInt::get(Int64Ty, be.backedge_inc));
             Builder.CreateStore(incrementedPath, PathRegister);
-            Builder.CreateCall(IncrementPathCountFunc, {FuncName, incrementedPath});
-            Builder.CreateStore(ConstantInt::get(Int64Ty, be.backedge_reset), PathRegister);
+            auto ResetStore = Builder.CreateStore(ConstantInt::get(Int64Ty, be.backedge_reset), PathRegister);
             Builder.CreateBr(dest);
 
             // Update PHI nodes in destination
@@ -254,26 +298,130 @@ public:
                 phi->removeIncomingValue(src);
                 phi->addIncoming(incomingValue, newbb);
             }
+
+            // Count the path before the register is reset
+            Builder.SetInsertPoint(ResetStore);
+            countPath(Builder, FuncName, incrementedPath);
         }
         
         // Add final path count increment at exit block
         BasicBlock *ExitBB = nodes[exitbb].bb;
         Builder.SetInsertPoint(ExitBB->getTerminator());
         Value *FinalPath = Builder.CreateLoad(Int64Ty, PathRegister);
-        Builder.CreateCall(IncrementPathCountFunc, {FuncName, FinalPath});
+        countPath(Builder, FuncName, FinalPath);
 
         // For main function, add call to print results before return
         if (F.getName() == "main") {
             Builder.CreateCall(getPrintResultsFunction(*M));
         }
     }
+
+    // Batch mode: register the path buffer with the runtime at the insert point of Builder
+    void registerPathBuffer(IRBuilder<>& Builder) {
+        LLVMContext &Context = Builder.getContext();
+        Module *M = Builder.GetInsertBlock()->getModule();
+        Builder.CreateCall(getRegisterPathBufferFunction(*M), {
+            funcName, pathBufferStart(Context), pathBufferLen, numPathsConstant(Context), counterConfig(Context)
+        });
+    }
 private:
+    BallLarusOptions opts;
+    GlobalVariable* pathBuffer = nullptr;   // [batchSize x i64] of finished paths (batch mode)
+    GlobalVariable* pathBufferLen = nullptr;    // number of paths in pathBuffer (batch mode)
+    Constant* funcName = nullptr;   // passed to the runtime with the buffer (batch mode)
     std::vector<Node> nodes;
     std::vector<BackEdge> backedges;
     uint64_t entrybb;
     uint64_t exitbb;
     uint64_t numPath;
 
+    /*
+    Batch mode keeps a buffer of finished path ids per function
+    1. the buffer and its length are internal globals of the module
+    2. a module constructor registers them with the runtime (registerPathBuffer), so __print_results can flush partial buffers
+    3. when the buffer is full, it is handed to __flush_path_buffer and emptied
+    */
+    void createPathBuffer(Function& F) {
+        Module *M = F.getParent();
+        LLVMContext &Context = F.getContext();
+        Type *Int64Ty = Type::getInt64Ty(Context);
+        ArrayType *BufferTy = ArrayType::get(Int64Ty, opts.batchSize);
+
+        pathBuffer = new GlobalVariable(
+            *M,
+            BufferTy,
+            false,
+            GlobalValue::InternalLinkage,
+            ConstantAggregateZero::get(BufferTy),
+            "path_buffer." + F.getName()
+        );
+        pathBufferLen = new GlobalVariable(
+            *M,
+            Int64Ty,
+            false,
+            GlobalValue::InternalLinkage,
+            ConstantInt::get(Int64Ty, 0),
+            "path_buffer_len." + F.getName()
+        );
+    }
+
+    Constant* numPathsConstant(LLVMContext& Context) {
+        return ConstantInt::get(Type::getInt64Ty(Context), numPath);
+    }
+
+    // Counter width in bytes | saturate << 8, see PathCounters in the runtime
+    Constant* counterConfig(LLVMContext& Context) {
+        uint64_t bits = numPath >= opts.counterMinPaths ? opts.counterBits : 64;
+        return ConstantInt::get(Type::getInt64Ty(Context), bits / 8 | uint64_t(opts.saturate) << 8);
+    }
+
+    Constant* pathBufferStart(LLVMContext& Context) {
+        Constant *Zero = ConstantInt::get(Type::getInt32Ty(Context), 0);
+        Constant *Indices[] = {Zero, Zero};
+        return ConstantExpr::getGetElementPtr(pathBuffer->getValueType(), pathBuffer, Indices, true);
+    }
+
+    // Count a finished path at the insert point of Builder, which is left in front of the same instruction
+    void countPath(IRBuilder<>& Builder, Constant* FuncName, Value* path) {
+        Module *M = Builder.GetInsertBlock()->getModule();
+        LLVMContext &Context = M->getContext();
+        if (!opts.batch) {
+            Builder.CreateCall(getIncrementPathCountFunction(*M), {FuncName, path, numPathsConstant(Context), counterConfig(Context)});
+            return;
+        }
+
+        Type *Int64Ty = Type::getInt64Ty(Context);
+        Instruction *InsertPt = &*Builder.GetInsertPoint();
+
+        // buffer[len++] = path
+        Value *Len = Builder.CreateLoad(Int64Ty, pathBufferLen);
+        Value *Slot = Builder.CreateInBoundsGEP(
+            pathBuffer->getValueType(),
+            pathBuffer,
+            {ConstantInt::get(Int64Ty, 0), Len}
+        );
+        Builder.CreateStore(path, Slot);
+        Value *NewLen = Builder.CreateAdd(Len, ConstantInt::get(Int64Ty, 1));
+        Builder.CreateStore(NewLen, pathBufferLen);
+
+        // if (len == batchSize || __hot_path_threshold != 0) { flush; len = 0; }
+        // with hot path detection on, every path is flushed, so it is checked against the threshold right away
+        Value *Full = Builder.CreateICmpEQ(NewLen, ConstantInt::get(Int64Ty, opts.batchSize));
+        LoadInst *Threshold = Builder.CreateLoad(Int64Ty, getHotPathThreshold(*M));
+        Threshold->setAtomic(AtomicOrdering::Monotonic);
+        Threshold->setAlignment(Align(8));
+        Value *Detecting = Builder.CreateICmpNE(Threshold, ConstantInt::get(Int64Ty, 0));
+        Instruction *ThenTerm = SplitBlockAndInsertIfThen(Builder.CreateOr(Full, Detecting), InsertPt, false);
+        ThenTerm->getParent()->setName("flush_paths");
+        Builder.SetInsertPoint(ThenTerm);
+        Builder.CreateCall(getFlushPathBufferFunction(*M), {
+            FuncName, pathBufferStart(Context), NewLen, numPathsConstant(Context), counterConfig(Context)
+        });
+        Builder.CreateStore(ConstantInt::get(Int64Ty, 0), pathBufferLen);
+
+        Builder.SetInsertPoint(InsertPt);
+    }
+
     void detect_replace_backedges(std::unordered_map<BasicBlock*, uint64_t>& bbId) {
         // color = 0 is white, 1 = gray, 2 = black
         // white (0) = unvisited
@@ -387,16 +535,92 @@ private:
 
 class BallLarusPass : public PassInfoMixin<BallLarusPass> {
 private:
+    BallLarusOptions opts;
 public:
-    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
-        Graph g(F);
-        g.writeOutput(F);
-        g.instrument(F);
+    BallLarusPass(BallLarusOptions opts = {}) : opts(opts) {}
+
+    // A module pass, batch mode adds a constructor that registers the path buffers of all functions
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+        std::vector<Function*> funcs;
+        for (auto& F : M) {
+            if (!F.isDeclaration()) {
+                funcs.push_back(&F);
+            }
+        }
+
+        LLVMContext &Context = M.getContext();
+        IRBuilder<> Register(Context);
+        if (opts.batch && !funcs.empty()) {
+            FunctionType *CtorTy = FunctionType::get(Type::getVoidTy(Context), {}, false);
+            Function *Ctor = Function::Create(
+                CtorTy,
+                GlobalValue::InternalLinkage,
+                "__ball_larus.register_path_buffers",
+                M
+            );
+            Register.SetInsertPoint(BasicBlock::Create(Context, "entry", Ctor));
+            Register.SetInsertPoint(Register.CreateRetVoid());
+            appendToGlobalCtors(M, Ctor, 65535);
+        }
+
+        for (auto F : funcs) {
+            Graph g(*F, opts);
+            g.writeOutput(*F);
+            g.instrument(*F);
+            if (opts.batch) {
+                g.registerPathBuffer(Register);
+            }
+        }
         return PreservedAnalyses::none();
     }
 
     static bool isRequired() { return true; }
 };
+
+// Parse the "<...>" part of "ball-larus<...>", options are separated by ';'
+bool parseOptions(StringRef Params, BallLarusOptions& opts) {
+    if (Params.empty()) {
+        return true;
+    }
+    if (!Params.consume_front("<") || !Params.consume_back(">")) {
+        return false;
+    }
+    while (!Params.empty()) {
+        StringRef Param;
+        std::tie(Param, Params) = Params.split(';');
+        if (Param == "batch") {
+            opts.batch = true;
+        }
+        else if (Param.consume_front("batch=")) {
+            opts.batch = true;
+            if (Param.getAsInteger(10, opts.batchSize) || opts.batchSize == 0) {
+                errs() << "Invalid ball-larus batch size: " << Param << "\n";
+                return false;
+            }
+        }
+        else if (Param.consume_front("counter=")) {
+            if (Param.getAsInteger(10, opts.counterBits) || !(opts.counterBits == 8 || opts.counterBits == 16
+                    || opts.counterBits == 32 || opts.counterBits == 64)) {
+                errs() << "Invalid ball-larus counter width: " << Param << "\n";
+                return false;
+            }
+        }
+        else if (Param.consume_front("counter-min-paths=")) {
+            if (Param.getAsInteger(10, opts.counterMinPaths)) {
+                errs() << "Invalid ball-larus counter-min-paths: " << Param << "\n";
+                return false;
+            }
+        }
+        else if (Param == "saturate") {
+            opts.saturate = true;
+        }
+        else {
+            errs() << "Unknown ball-larus option: " << Param << "\n";
+            return false;
+        }
+    }
+    return true;
+}
 }
 
 // Register the pass
@@ -408,10 +632,11 @@ llvmGetPassPluginInfo() {
         .PluginVersion = "v0.1",
         .RegisterPassBuilderCallbacks = [](PassBuilder &PB) {
             PB.registerPipelineParsingCallback(
-                [](StringRef Name, FunctionPassManager &FPM,
+                [](StringRef Name, ModulePassManager &MPM,
                    ArrayRef<PassBuilder::PipelineElement>) {
-                    if (Name == "ball-larus") {
-                        FPM.addPass(BallLarusPass());
+                    BallLarusOptions opts;
+                    if (Name.consume_front("ball-larus") && parseOptions(Name, opts)) {
+                        MPM.addPass(BallLarusPass(opts));
                         return true;
                     }
                     return false;
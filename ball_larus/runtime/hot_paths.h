@@ -0,0 +1,38 @@
+#ifndef BALL_LARUS_HOT_PATHS_H
+#define BALL_LARUS_HOT_PATHS_H
+
+#include <stddef.h>
+
+/*
+Online hot path detection of the Ball-Larus runtime
+When a hot threshold is set, the runtime publishes an event the first time the count of a path reaches it.
+Events go to a lock-free ring buffer, which one consumer thread drains while the program runs.
+Events are dropped while the ring buffer is full.
+In batch mode, every path is flushed to the runtime while a threshold is set, so events are not delayed
+until a buffer fills, but batching saves nothing during that time.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ball_larus_hot_path {
+    const char* function;   /* name of the function, valid until the program exits */
+    unsigned long path;     /* path id, see {FunctionName}.txt */
+    unsigned long count;    /* count of the path when it became hot */
+};
+
+/* Set the count at which a path becomes hot, 0 (the default) disables detection */
+void ball_larus_set_hot_threshold(unsigned long threshold);
+
+/* Move up to max events into out, returns the number of events moved */
+size_t ball_larus_drain_hot_paths(struct ball_larus_hot_path* out, size_t max);
+
+/* Number of events dropped because the ring buffer was full */
+unsigned long ball_larus_dropped_hot_paths(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,29 +1,321 @@
+#include "hot_paths.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <unordered_map>
 #include <string>
+#include <vector>
+
+/*
+Counts of one function, the counter width and overflow behaviour are chosen by the pass
+config = width in bytes (1, 2, 4 or 8) | saturate << 8
+- saturate: a counter stays at its maximum value
+- otherwise: the value of an overflowing counter is moved into a 64-bit spill map and the counter restarts at 0
+A dense array indexed by path id is used when it is no larger than the initial open addressing table,
+otherwise the table only grows with the paths that actually run.
+Counters are shared by name, so a function with the same name in another module (e.g. a static helper)
+may have more paths; its first path id beyond the dense array turns the array into a table.
+*/
+class PathCounters {
+public:
+    PathCounters(unsigned long numPaths, unsigned long config)
+        : width(config & 0xff ? config & 0xff : 8),
+          saturate(config >> 8 & 1),
+          dense(numPaths != 0 && numPaths <= InitialSlots * (sizeof(unsigned long) + width) / width) {
+        if (dense) {
+            counters.resize(numPaths * width);
+        }
+        else {
+            keys.assign(InitialSlots, Empty);
+            counters.resize(InitialSlots * width);
+        }
+    }
+
+    // Add n to the count of path, returns the new count if it reached hotThreshold with this addition, otherwise 0
+    unsigned long add(unsigned long path, unsigned long n, unsigned long hotThreshold = 0) {
+        if (dense && path >= counters.size() / width) {
+            makeSparse();
+        }
+        unsigned char* slot = &counters[(dense ? path : findSlot(path)) * width];
+        switch (width) {
+            case 1: return addTo<unsigned char>(path, slot, n, hotThreshold);
+            case 2: return addTo<unsigned short>(path, slot, n, hotThreshold);
+            case 4: return addTo<unsigned int>(path, slot, n, hotThreshold);
+            default: return addTo<unsigned long>(path, slot, n, hotThreshold);
+        }
+    }
+
+    // Call f(path, count) for every path with a non-zero count
+    template <typename F>
+    void forEach(F&& f) const {
+        auto numSlots = counters.size() / width;
+        for (unsigned long i = 0; i < numSlots; ++i) {
+            if (!dense && keys[i] == Empty) {
+                continue;
+            }
+            unsigned long path = dense ? i : keys[i];
+            auto it = spill.find(path);
+            unsigned long c = read(i) + (it == spill.end() ? 0 : it->second);
+            if (c != 0) {
+                f(path, c);
+            }
+        }
+    }
+
+    // Approximate heap usage in bytes
+    size_t memory() const {
+        // each spill entry is a node with the key, value and next pointer, plus its bucket
+        size_t spillNode = sizeof(void*) + 2 * sizeof(unsigned long);
+        return counters.capacity() + keys.capacity() * sizeof(unsigned long)
+            + spill.size() * spillNode + spill.bucket_count() * sizeof(void*);
+    }
+
+    unsigned long numPaths() const {
+        return dense ? counters.size() / width : size;
+    }
+private:
+    static constexpr unsigned long InitialSlots = 16;       // of the open addressing table
+    static constexpr unsigned long Empty = std::numeric_limits<unsigned long>::max();
+
+    unsigned long width;
+    bool saturate;
+    bool dense;
+    unsigned long size = 0;                     // used slots of the sparse table
+    std::vector<unsigned long> keys;            // path id of each slot of the sparse table
+    std::vector<unsigned char> counters;        // width bytes per slot
+    std::unordered_map<unsigned long, unsigned long> spill;
+
+    template <typename T>
+    unsigned long addTo(unsigned long path, unsigned char* slot, unsigned long n, unsigned long hotThreshold) {
+        constexpr unsigned long max = std::numeric_limits<T>::max();
+        T c;
+        std::memcpy(&c, slot, sizeof(T));
+
+        // The spilled part is only needed to detect hot paths
+        unsigned long before = c;
+        if (hotThreshold != 0 && !spill.empty()) {
+            auto it = spill.find(path);
+            before += it == spill.end() ? 0 : it->second;
+        }
+        unsigned long after = before + n;
+
+        if (n <= max - c) {
+            c += n;
+        }
+        else if (saturate || sizeof(T) == sizeof(unsigned long)) {
+            after = before - c + max;
+            c = max;
+        }
+        else {
+            spill[path] += c + n;
+            c = 0;
+        }
+        std::memcpy(slot, &c, sizeof(T));
+
+        return hotThreshold != 0 && before < hotThreshold && after >= hotThreshold ? after : 0;
+    }
+
+    unsigned long read(unsigned long i) const {
+        const unsigned char* slot = &counters[i * width];
+        switch (width) {
+            case 1: return readAs<unsigned char>(slot);
+            case 2: return readAs<unsigned short>(slot);
+            case 4: return readAs<unsigned int>(slot);
+            default: return readAs<unsigned long>(slot);
+        }
+    }
+
+    template <typename T>
+    static unsigned long readAs(const unsigned char* slot) {
+        T c;
+        std::memcpy(&c, slot, sizeof(T));
+        return c;
+    }
+
+    // Linear probing, the table is grown to keep it at most 70% full
+    unsigned long findSlot(unsigned long path) {
+        unsigned long mask = keys.size() - 1;
+        unsigned long i = (path * 0x9e3779b97f4a7c15ul) >> 32 & mask;
+        while (keys[i] != path) {
+            if (keys[i] == Empty) {
+                if ((size + 1) * 10 > keys.size() * 7) {
+                    grow();
+                    return findSlot(path);
+                }
+                keys[i] = path;
+                ++size;
+                return i;
+            }
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
 
-std::unordered_map<std::string, std::unordered_map<unsigned long, unsigned long>> cnts;
+    void makeSparse() {
+        std::vector<unsigned char> denseCounters = std::move(counters);
+        dense = false;
+        keys.assign(InitialSlots, Empty);
+        counters.assign(InitialSlots * width, 0);
+        for (unsigned long path = 0; path < denseCounters.size() / width; ++path) {
+            if (std::any_of(&denseCounters[path * width], &denseCounters[(path + 1) * width], [](auto b) { return b != 0; })) {
+                std::memcpy(&counters[findSlot(path) * width], &denseCounters[path * width], width);
+            }
+        }
+    }
+
+    void grow() {
+        std::vector<unsigned long> oldKeys = std::move(keys);
+        std::vector<unsigned char> oldCounters = std::move(counters);
+        keys.assign(oldKeys.size() * 2, Empty);
+        counters.assign(oldCounters.size() * 2, 0);
+        size = 0;
+        for (unsigned long i = 0; i < oldKeys.size(); ++i) {
+            if (oldKeys[i] != Empty) {
+                std::memcpy(&counters[findSlot(oldKeys[i]) * width], &oldCounters[i * width], width);
+            }
+        }
+    }
+};
+
+std::unordered_map<std::string, PathCounters> cnts;
+
+// Path buffer of a function instrumented in batch mode
+struct PathBuffer {
+    const char* fname;
+    unsigned long* buf;
+    unsigned long* len;
+    unsigned long numPaths;
+    unsigned long config;
+};
+
+// Registered from global constructors, so it must not depend on static initialization order
+std::vector<PathBuffer>& pathBuffers() {
+    static std::vector<PathBuffer> buffers;
+    return buffers;
+}
 
+/*
+Hot path events, a single producer single consumer ring buffer
+- the producer is the instrumented program, which already updates the counts without locking
+- the consumer calls ball_larus_drain_hot_paths
+*/
+constexpr size_t HotRingSize = 1024;   // power of 2
+// Read by the batch mode instrumentation, which flushes every path while it is not 0
+static_assert(sizeof(std::atomic<unsigned long>) == sizeof(unsigned long) && std::atomic<unsigned long>::is_always_lock_free);
 extern "C" {
-    void __increment_path_count(const char* fname, unsigned long path) {
-        ++cnts[std::string(fname)][path];
+    std::atomic<unsigned long> __hot_path_threshold{0};
+}
+ball_larus_hot_path hotRing[HotRingSize];
+std::atomic<size_t> hotHead{0};     // next slot written by the producer
+std::atomic<size_t> hotTail{0};     // next slot read by the consumer
+std::atomic<unsigned long> hotDropped{0};
+
+void publishHotPath(const char* fname, unsigned long path, unsigned long count) {
+    size_t head = hotHead.load(std::memory_order_relaxed);
+    if (head - hotTail.load(std::memory_order_acquire) == HotRingSize) {
+        hotDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    hotRing[head & (HotRingSize - 1)] = {fname, path, count};
+    hotHead.store(head + 1, std::memory_order_release);
+}
+
+// The bitcode runtime is linked into the instrumented module, so the counter update can be inlined
+#ifdef BALL_LARUS_ALWAYS_INLINE
+#define BALL_LARUS_FAST_PATH __attribute__((always_inline))
+#else
+#define BALL_LARUS_FAST_PATH
+#endif
+
+// Counts of the function counted last, consecutive paths usually finish in the same function.
+// Each module has its own copy of a function name, so the pointer only identifies the name in the cache.
+const char* lastFname = nullptr;
+PathCounters* lastCnt = nullptr;
+
+__attribute__((noinline)) PathCounters& lookupCounts(const char* fname, unsigned long numPaths, unsigned long config) {
+    lastFname = fname;
+    lastCnt = &cnts.try_emplace(std::string(fname), numPaths, config).first->second;
+    return *lastCnt;
+}
+
+extern "C" {
+    BALL_LARUS_FAST_PATH void __increment_path_count(const char* fname, unsigned long path, unsigned long numPaths, unsigned long config) {
+        auto& cnt = fname == lastFname ? *lastCnt : lookupCounts(fname, numPaths, config);
+        if (auto hotCount = cnt.add(path, 1, __hot_path_threshold.load(std::memory_order_relaxed))) {
+            publishHotPath(fname, path, hotCount);
+        }
+    }
+
+    // Reduce a batch of finished paths: sort them and add the length of each run of equal ids
+    void __flush_path_buffer(const char* fname, unsigned long* buf, unsigned long n, unsigned long numPaths, unsigned long config) {
+        std::sort(buf, buf + n);
+        auto& cnt = fname == lastFname ? *lastCnt : lookupCounts(fname, numPaths, config);
+        for (unsigned long i = 0, j = 0; i < n; i = j) {
+            while (j < n && buf[j] == buf[i]) {
+                ++j;
+            }
+            if (auto hotCount = cnt.add(buf[i], j - i, __hot_path_threshold.load(std::memory_order_relaxed))) {
+                publishHotPath(fname, buf[i], hotCount);
+            }
+        }
+    }
+
+    void __register_path_buffer(const char* fname, unsigned long* buf, unsigned long* len, unsigned long numPaths, unsigned long config) {
+        pathBuffers().push_back({fname, buf, len, numPaths, config});
+    }
+
+    void ball_larus_set_hot_threshold(unsigned long threshold) {
+        __hot_path_threshold.store(threshold, std::memory_order_relaxed);
+    }
+
+    size_t ball_larus_drain_hot_paths(ball_larus_hot_path* out, size_t max) {
+        size_t tail = hotTail.load(std::memory_order_relaxed);
+        size_t n = std::min(hotHead.load(std::memory_order_acquire) - tail, max);
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = hotRing[(tail + i) & (HotRingSize - 1)];
+        }
+        hotTail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    unsigned long ball_larus_dropped_hot_paths() {
+        return hotDropped.load(std::memory_order_relaxed);
     }
 
     void __print_results() {
+        // Flush the partially filled buffers, a function that never ran has no counts
+        for (auto& pb : pathBuffers()) {
+            if (*pb.len == 0) {
+                continue;
+            }
+            __flush_path_buffer(pb.fname, pb.buf, *pb.len, pb.numPaths, pb.config);
+            *pb.len = 0;
+        }
+
         std::ofstream outFile("profile.txt");
         if (!outFile) {
             std::cerr << "Error: Could not open profile.txt for writing\n";
             return;
         }
 
+        size_t memory = 0;
+        unsigned long numPaths = 0;
         for (auto& [fname, cnt] : cnts) {
             outFile << "Function: " << fname << '\n';
-            for (auto [path, c] : cnt) {
+            cnt.forEach([&](unsigned long path, unsigned long c) {
                 outFile << path << ": " << c << '\n';
-            }
+            });
             outFile << '\n';
+            memory += cnt.memory();
+            numPaths += cnt.numPaths();
         }
         outFile.close();
+
+        std::cerr << "Ball-Larus runtime memory: " << memory << " bytes for " << numPaths
+            << " path counters in " << cnts.size() << " functions\n";
     }
-}
\ No newline at end of file
+}
@@ -1,27 +1,58 @@
 #!/bin/bash
 
 # Check if input file is provided
-if [ $# -ne 1 ]; then
-    echo "Usage: $0 <input.c>"
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+    echo "Usage: $0 <input.c> [pass pipeline, default ball-larus]"
     exit 1
 fi
 
 rm -f *.bc *.ll
 
 INPUT_FILE=$1
+PASSES=${2:-ball-larus}
 BASENAME=$(basename "$INPUT_FILE" .c)
 
 # Compile to LLVM IR
+# The bitcode runtime is optimized together with the user code, which clang marks optnone at -O0.
+# The IR itself stays unoptimized, so the pass sees the same CFG in every mode.
+CLANG_FLAGS=""
+if [ "${BALL_LARUS_RUNTIME:-shared}" = "bitcode" ]; then
+    CLANG_FLAGS="-Xclang -disable-O0-optnone"
+fi
 echo "Compiling to LLVM IR..."
-clang -S -emit-llvm "$INPUT_FILE" -o "$BASENAME.ll"
+clang $CLANG_FLAGS -S -emit-llvm "$INPUT_FILE" -o "$BASENAME.ll"
 
 # Run the pass
 echo "Running Ball-Larus pass..."
-opt -load-pass-plugin=./ball_larus/BallLarusPass.so -passes=ball-larus "$BASENAME.ll" -o "instrumented_$BASENAME.bc"
+opt -load-pass-plugin=./ball_larus/BallLarusPass.so -passes="$PASSES" "$BASENAME.ll" -o "instrumented_$BASENAME.bc"
 
 # Compile final binary
+# BALL_LARUS_RUNTIME selects how the runtime is linked: shared (default), static or bitcode
 echo "Compiling instrumented program..."
-clang "instrumented_$BASENAME.bc" $(pwd)/lib/libBallLarusRuntime.so -o "instrumented_$BASENAME" -Wl,-rpath,$(pwd)/lib
+case "${BALL_LARUS_RUNTIME:-shared}" in
+    shared)
+        clang "instrumented_$BASENAME.bc" $(pwd)/lib/libBallLarusRuntime.so -o "instrumented_$BASENAME" -Wl,-rpath,$(pwd)/lib
+        ;;
+    static)
+        clang++ "instrumented_$BASENAME.bc" $(pwd)/lib/libBallLarusRuntime.a -o "instrumented_$BASENAME"
+        ;;
+    bitcode)
+        # Link the runtime into the module so counter updates are optimized with the user code
+        llvm-link "instrumented_$BASENAME.bc" $(pwd)/lib/BallLarusRuntime.bc -o "linked_$BASENAME.bc"
+        opt -O2 "linked_$BASENAME.bc" -o "linked_$BASENAME.bc"
+        # The counter update is always_inline, a call left means the runtime was not built for inlining
+        calls=$(llvm-dis "linked_$BASENAME.bc" -o - | grep -c "call .*@__increment_path_count(")
+        if [ "$calls" -ne 0 ]; then
+            echo "Error: $calls calls to __increment_path_count were not inlined"
+            exit 1
+        fi
+        clang++ -O2 "linked_$BASENAME.bc" -o "instrumented_$BASENAME"
+        ;;
+    *)
+        echo "Unknown BALL_LARUS_RUNTIME: $BALL_LARUS_RUNTIME (expected shared, static or bitcode)"
+        exit 1
+        ;;
+esac
 
 echo "Running ./instrumented_$BASENAME..."
 
@@ -5,11 +5,129 @@
 #include <stdexcept>
 #include <unordered_map>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <cmath>
+#include <deque>
+#include <regex>
+#include <cstring>
 
 namespace fs = std::filesystem;
 
 uint64_t hot_path_threshold = 1;
 
+// Static cost of a basic block or a path, counted from the recorded IR
+struct Cost {
+    uint64_t insts = 0;     // instructions, without phi nodes
+    uint64_t memOps = 0;    // load, store, atomicrmw and cmpxchg
+    uint64_t calls = 0;     // call, invoke and callbr
+
+    Cost& operator+=(Cost const& other) {
+        insts += other.insts;
+        memOps += other.memOps;
+        calls += other.calls;
+        return *this;
+    }
+};
+
+// Cost of an executed path, weighted by its count
+struct PathCost {
+    std::string func;
+    uint64_t pathId;
+    uint64_t cnt;
+    Cost cost;
+};
+
+// Intrinsics which only carry information for the optimizer or debugger and produce no code
+bool isMarkerIntrinsic(std::string const& line) {
+    static const std::regex callee(R"([@%][\w.$-]+\()");
+    static const char* markers[] = {
+        "@llvm.dbg.", "@llvm.lifetime.", "@llvm.assume(", "@llvm.invariant.", "@llvm.pseudoprobe(",
+        "@llvm.var.annotation(", "@llvm.donothing(", "@llvm.experimental.noalias.scope.decl(",
+    };
+
+    // The callee is the first name followed by its argument list
+    std::smatch match;
+    if (!std::regex_search(line, match, callee)) {
+        return false;
+    }
+    std::string name = match.str();
+    for (auto marker : markers) {
+        if (name.compare(0, std::strlen(marker), marker) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Clause line of a landingpad, e.g. "catch i8* null"
+bool isClause(std::string const& line) {
+    return line == "cleanup" || line.compare(0, 6, "catch ") == 0 || line.compare(0, 7, "filter ") == 0;
+}
+
+// Cost of one instruction line, e.g. "%1 = tail call i32 @foo()"
+Cost instructionCost(std::string const& line) {
+    std::istringstream iss(line);
+    std::string opcode;
+    iss >> opcode;
+    if (!opcode.empty() && opcode[0] == '%') {
+        iss >> opcode >> opcode;    // skip "%x ="
+    }
+    if (opcode == "tail" || opcode == "musttail" || opcode == "notail") {
+        iss >> opcode;
+    }
+
+    Cost cost;
+    if (opcode.empty() || opcode == "phi" || (opcode == "call" && isMarkerIntrinsic(line))) {
+        return cost;
+    }
+    cost.insts = 1;
+    cost.memOps = opcode == "load" || opcode == "store" || opcode == "atomicrmw" || opcode == "cmpxchg";
+    cost.calls = opcode == "call" || opcode == "invoke" || opcode == "callbr";
+    return cost;
+}
+
+// Read profile.txt one function at a time, calling f(funcName, pathCnts) for each
+template <typename F>
+void forEachFunction(std::istream& stream, F&& f) {
+    std::string line;
+    std::string funcName;
+    std::unordered_map<uint64_t, uint64_t> pathCnts;
+
+    while (std::getline(stream, line)) {
+        if (line.empty()) continue;
+
+        // Check if this is a function header
+        if (line.substr(0, 9) == "Function:") {
+            // If we have a previous function's data, process it
+            if (!funcName.empty()) {
+                f(funcName, std::move(pathCnts));
+                pathCnts.clear();
+            }
+
+            // Extract new function name (skip "Function: " prefix)
+            funcName = line.substr(10);
+            continue;
+        }
+
+        // Process path count line
+        size_t colonPos = line.find(':');
+        if (colonPos != std::string::npos) {
+            uint64_t pathId, count;
+            std::istringstream(line.substr(0, colonPos)) >> pathId;
+            std::istringstream(line.substr(colonPos + 2)) >> count;
+            pathCnts[pathId] = count;
+        }
+    }
+
+    // process last function
+    if (!funcName.empty()) {
+        f(funcName, std::move(pathCnts));
+    }
+}
+
 // Used for regenerating the path from the pathId within a function
 class BallLarusRegen {
     struct To {
@@ -63,9 +181,11 @@ public:
         std::getline(stream, line);
         
         // Read basic blocks
+        bool inSwitch = false;  // between "switch ... [" and "]"
         while (std::getline(stream, line)) {
             if (line[0] == 'b') {  // Basic block header
                 bbs.push_back("");  // Add new basic block
+                bbCosts.push_back({});
                 continue;
             }
             
@@ -81,6 +201,15 @@ public:
                 bbs.back() += '\n';
             }
             bbs.back() += line;
+
+            // Switch cases and landingpad clauses are printed on their own lines, but belong to the previous instruction
+            if (inSwitch) {
+                inSwitch = line[0] != ']';
+            }
+            else if (!isClause(line)) {
+                bbCosts.back() += instructionCost(line);
+                inSwitch = line.compare(0, 7, "switch ") == 0 && line.back() == '[';
+            }
         }
     }
 
@@ -91,6 +220,7 @@ public:
         for (auto [pathId, cnt] : pathCnts) {
             std::vector<uint64_t> path = regeneratePath(pathId);
             printRecord(stream, path, cnt, currColdPaths);
+            pathCosts.push_back({outputPath.stem().string(), pathId, cnt, pathCost(path)});
         }
 
         // sample and print cold paths
@@ -103,6 +233,11 @@ public:
             ++nextPath;
         }
     }
+
+    // Costs of the executed paths, available after output()
+    std::vector<PathCost>& costs() {
+        return pathCosts;
+    }
 private:
     fs::path outputPath;
     uint64_t numPath;
@@ -110,6 +245,8 @@ private:
     uint64_t exitbb;
     std::unordered_map<uint64_t, uint64_t> pathCnts;
     std::vector<std::string> bbs;
+    std::vector<Cost> bbCosts;
+    std::vector<PathCost> pathCosts;
     std::vector<std::vector<To>> tos;
 
     std::vector<uint64_t> regeneratePath(uint64_t pathId) {
@@ -141,6 +278,14 @@ private:
         return path;
     }
 
+    Cost pathCost(std::vector<uint64_t> const& path) {
+        Cost cost;
+        for (auto bb : path) {
+            cost += bbCosts[bb];
+        }
+        return cost;
+    }
+
     void printRecord(std::ofstream& stream, std::vector<uint64_t> const& path, uint64_t cnt, uint64_t& currColdPaths) {
         stream << "\"";
         stream << bbs[path[0]];
@@ -154,14 +299,312 @@ private:
     }
 };
 
+// Compares the path profiles of two builds.
+// Profile A is kept in memory, profile B is read in chunks of functions, and each thread only keeps
+// the numDeltas largest changes, so memory is bounded by profile A plus one chunk of profile B.
+class ProfileDiff {
+    // A function of profile A
+    struct Function {
+        std::unordered_map<uint64_t, uint64_t> cnts;
+        uint64_t cfgHash;
+        bool inB = false;
+    };
+
+    // A function waiting to be compared
+    struct Work {
+        std::string const* func;
+        Function const* a;      // nullptr if the function is not in profile A
+        std::unordered_map<uint64_t, uint64_t> cntsB;
+        uint64_t cfgHashB;
+        bool inB;
+    };
+
+    struct Delta {
+        std::string const* func;
+        uint64_t path;
+        bool wholeFunction;     // counts of the whole function, path ids are not comparable
+        uint64_t cntA;
+        uint64_t cntB;
+        double shareA;          // count normalized by total executions of profile A
+        double shareB;
+        char const* status;
+
+        double impact() const {
+            return std::abs(shareB - shareA);
+        }
+
+        // Larger impact first, ties by function name and path id, so the output does not depend on threads
+        bool ranksBefore(Delta const& other) const {
+            if (impact() != other.impact()) {
+                return impact() > other.impact();
+            }
+            if (int c = func->compare(*other.func)) {
+                return c < 0;
+            }
+            return path < other.path;
+        }
+    };
+public:
+    ProfileDiff(fs::path const& dirA, fs::path const& dirB, uint64_t numDeltas)
+        : dirA(dirA), dirB(dirB), numDeltas(numDeltas),
+          numThreads(std::max(1u, std::thread::hardware_concurrency())), heaps(numThreads) {}
+
+    // Print the numDeltas path changes with the largest shift in normalized count
+    void output(std::ostream& stream) {
+        readA();
+        totalB = 0;
+        auto countB = open(dirB);
+        forEachFunction(countB, [&](std::string const&, std::unordered_map<uint64_t, uint64_t>&& pathCnts) {
+            totalB += sum(pathCnts);
+        });
+
+        // Second pass over profile B, compared chunk by chunk
+        std::vector<Work> chunk;
+        uint64_t chunkPaths = 0;
+        auto streamB = open(dirB);
+        forEachFunction(streamB, [&](std::string const& funcName, std::unordered_map<uint64_t, uint64_t>&& pathCnts) {
+            auto it = funcsA.find(funcName);
+            Function const* a = nullptr;
+            std::string const* name;
+            if (it != funcsA.end()) {
+                it->second.inB = true;
+                a = &it->second;
+                name = &it->first;
+            }
+            else {
+                addedNames.push_back(funcName);
+                name = &addedNames.back();
+            }
+            chunkPaths += pathCnts.size();
+            chunk.push_back({name, a, std::move(pathCnts), cfgHash(dirB / (funcName + ".txt")), true});
+            if (chunkPaths >= ChunkPaths) {
+                compareChunk(chunk);
+                chunkPaths = 0;
+            }
+        });
+        for (auto& [name, func] : funcsA) {
+            if (!func.inB) {
+                chunk.push_back({&name, &func, {}, 0, false});
+            }
+        }
+        compareChunk(chunk);
+
+        std::vector<Delta> deltas;
+        for (auto& heap : heaps) {
+            deltas.insert(deltas.end(), heap.begin(), heap.end());
+        }
+        std::sort(deltas.begin(), deltas.end(), [](auto& a, auto& b) {
+            return a.ranksBefore(b);
+        });
+        deltas.resize(std::min<size_t>(numDeltas, deltas.size()));
+
+        stream << "Total Executions: " << totalA << ", " << totalB << '\n';
+        stream << "Function, Path, Count A, Count B, Share A, Share B, Delta, Status\n";
+        for (auto& d : deltas) {
+            stream << *d.func << ", ";
+            if (d.wholeFunction) {
+                stream << '*';
+            }
+            else {
+                stream << d.path;
+            }
+            stream << ", " << d.cntA << ", " << d.cntB << ", " << d.shareA << ", " << d.shareB << ", "
+                << d.shareB - d.shareA << ", " << d.status << '\n';
+        }
+    }
+private:
+    static constexpr uint64_t ChunkPaths = 1 << 20;
+
+    fs::path dirA;
+    fs::path dirB;
+    uint64_t numDeltas;
+    unsigned numThreads;
+    uint64_t totalA = 0;
+    uint64_t totalB = 0;
+    std::unordered_map<std::string, Function> funcsA;
+    std::deque<std::string> addedNames;     // functions only in profile B
+    std::vector<std::vector<Delta>> heaps;  // min-heap of the largest changes of each thread
+
+    static std::ifstream open(fs::path const& dir) {
+        fs::path prof = dir / "profile.txt";
+        std::ifstream stream(prof);
+        if (!stream) {
+            throw std::runtime_error("Could not open " + prof.string() + " for reading");
+        }
+        return stream;
+    }
+
+    void readA() {
+        auto streamA = open(dirA);
+        forEachFunction(streamA, [&](std::string const& funcName, std::unordered_map<uint64_t, uint64_t>&& pathCnts) {
+            totalA += sum(pathCnts);
+            funcsA[funcName] = {std::move(pathCnts), cfgHash(dirA / (funcName + ".txt"))};
+        });
+    }
+
+    // FNV-1a hash of the DAG written by the pass (everything before "Basic Blocks:"),
+    // path ids of two builds are only comparable when the hashes agree
+    static uint64_t cfgHash(fs::path const& path) {
+        std::ifstream stream(path);
+        if (!stream) {
+            throw std::runtime_error("Could not open " + path.string() + " for reading");
+        }
+
+        uint64_t hash = 14695981039346656037ull;
+        std::string line;
+        while (std::getline(stream, line) && line != "Basic Blocks:") {
+            for (char c : line + '\n') {
+                hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+            }
+        }
+        return hash;
+    }
+
+    static uint64_t sum(std::unordered_map<uint64_t, uint64_t> const& cnts) {
+        uint64_t total = 0;
+        for (auto [pathId, cnt] : cnts) {
+            total += cnt;
+        }
+        return total;
+    }
+
+    double share(uint64_t cnt, uint64_t total) const {
+        return total == 0 ? 0.0 : static_cast<double>(cnt) / total;
+    }
+
+    // Functions are independent, so they are compared in parallel; the chunk is emptied
+    void compareChunk(std::vector<Work>& chunk) {
+        std::atomic<size_t> next = 0;
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < numThreads; ++t) {
+            threads.emplace_back([&, t] {
+                for (size_t i = next++; i < chunk.size(); i = next++) {
+                    compare(chunk[i], heaps[t]);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        chunk.clear();
+    }
+
+    void keep(std::vector<Delta>& heap, Delta const& delta) const {
+        // The front of the heap is the change ranked last
+        auto ranksBefore = [](auto& a, auto& b) { return a.ranksBefore(b); };
+        if (heap.size() == numDeltas) {
+            if (!delta.ranksBefore(heap.front())) {
+                return;
+            }
+            std::pop_heap(heap.begin(), heap.end(), ranksBefore);
+            heap.pop_back();
+        }
+        heap.push_back(delta);
+        std::push_heap(heap.begin(), heap.end(), ranksBefore);
+    }
+
+    void compare(Work const& work, std::vector<Delta>& heap) const {
+        static std::unordered_map<uint64_t, uint64_t> const none;
+        auto& cntsA = work.a ? work.a->cnts : none;
+        auto& cntsB = work.cntsB;
+
+        // Without matching DAGs, only the function as a whole can be compared
+        char const* status = nullptr;
+        if (!work.a) {
+            status = "function added";
+        }
+        else if (!work.inB) {
+            status = "function removed";
+        }
+        else if (work.a->cfgHash != work.cfgHashB) {
+            status = "cfg changed";
+        }
+        if (status) {
+            uint64_t cntA = sum(cntsA);
+            uint64_t cntB = sum(cntsB);
+            keep(heap, {work.func, 0, true, cntA, cntB, share(cntA, totalA), share(cntB, totalB), status});
+            return;
+        }
+
+        for (auto [pathId, cntA] : cntsA) {
+            auto it = cntsB.find(pathId);
+            uint64_t cntB = it == cntsB.end() ? 0 : it->second;
+            keep(heap, {work.func, pathId, false, cntA, cntB, share(cntA, totalA), share(cntB, totalB),
+                cntB == 0 ? "disappeared" : "shifted"});
+        }
+        for (auto [pathId, cntB] : cntsB) {
+            if (!cntsA.count(pathId)) {
+                keep(heap, {work.func, pathId, false, 0, cntB, 0.0, share(cntB, totalB), "appeared"});
+            }
+        }
+    }
+};
+
+// Parse a non-negative integer command line argument
+uint64_t parseCount(char const* arg, char const* name) {
+    std::string str(arg);
+    if (str.empty() || str.find_first_not_of("0123456789") != std::string::npos) {
+        throw std::invalid_argument("Invalid " + std::string(name) + ": " + str);
+    }
+    try {
+        return std::stoull(str);
+    } catch (const std::out_of_range&) {
+        throw std::invalid_argument("Invalid " + std::string(name) + ": " + str);
+    }
+}
+
+// Rank executed paths by dynamic instruction count, i.e. static instructions times path count
+void writeCostReport(fs::path const& path, std::vector<PathCost>& pathCosts) {
+    std::sort(pathCosts.begin(), pathCosts.end(), [](auto& a, auto& b) {
+        return a.cost.insts * a.cnt > b.cost.insts * b.cnt;
+    });
+
+    uint64_t totalInsts = 0;
+    for (auto& pc : pathCosts) {
+        totalInsts += pc.cost.insts * pc.cnt;
+    }
+
+    std::ofstream stream(path);
+    if (!stream) {
+        throw std::runtime_error("Could not open " + path.string() + " for writing");
+    }
+    stream << "Function,Path,Count,Instructions,Memory Ops,Calls,"
+        << "Weighted Instructions,Weighted Memory Ops,Weighted Calls,Share of Instructions\n";
+    for (auto& pc : pathCosts) {
+        uint64_t weightedInsts = pc.cost.insts * pc.cnt;
+        stream << pc.func << ',' << pc.pathId << ',' << pc.cnt << ','
+            << pc.cost.insts << ',' << pc.cost.memOps << ',' << pc.cost.calls << ','
+            << weightedInsts << ',' << pc.cost.memOps * pc.cnt << ',' << pc.cost.calls * pc.cnt << ','
+            << (totalInsts == 0 ? 0.0 : static_cast<double>(weightedInsts) / totalInsts) << '\n';
+    }
+}
+
 int main(int argc, char* argv[]) {
     try {
+        if (argc >= 2 && std::string(argv[1]) == "--diff") {
+            if (argc < 4) {
+                std::cerr << "Usage: " << argv[0] << " --diff <directory_path_a> <directory_path_b>" << " [num_paths]\n";
+                return 1;
+            }
+            uint64_t numDeltas = 50;
+            if (argc >= 5) {
+                numDeltas = parseCount(argv[4], "num_paths");
+                if (numDeltas == 0) {
+                    throw std::invalid_argument("Invalid num_paths: 0");
+                }
+            }
+            ProfileDiff diff(argv[2], argv[3], numDeltas);
+            diff.output(std::cout);
+            return 0;
+        }
+
         if (argc < 2) {
             std::cerr << "Usage: " << argv[0] << " <directory_path>" << " [hot_path_threshold]\n";
+            std::cerr << "       " << argv[0] << " --diff <directory_path_a> <directory_path_b>" << " [num_paths]\n";
             return 1;
         }
         if (argc == 3) {
-            hot_path_threshold = atol(argv[2]);
+            hot_path_threshold = parseCount(argv[2], "hot_path_threshold");
         }
 
         fs::path dir(argv[1]);
@@ -171,46 +614,17 @@ int main(int argc, char* argv[]) {
             std::cerr << "Error: Could not open " << prof.string() << " for reading\n";
             return 1;
         }
-        std::string line;
-        std::string funcName;
-        std::unordered_map<uint64_t, uint64_t> pathCnts;
-
-        while (std::getline(stream, line)) {
-            if (line.empty()) continue;
-
-            // Check if this is a function header
-            if (line.substr(0, 9) == "Function:") {
-                // If we have a previous function's data, process it
-                if (!funcName.empty()) {
-                    fs::path filePath(prof);
-                    filePath.replace_filename(funcName + ".txt");
-                    BallLarusRegen regen(filePath, std::move(pathCnts));
-                    regen.output();
-                    pathCnts.clear();
-                }
-
-                // Extract new function name (skip "Function: " prefix)
-                funcName = line.substr(10);
-                continue;
-            }
-
-            // Process path count line
-            size_t colonPos = line.find(':');
-            if (colonPos != std::string::npos) {
-                uint64_t pathId, count;
-                std::istringstream(line.substr(0, colonPos)) >> pathId;
-                std::istringstream(line.substr(colonPos + 2)) >> count;
-                pathCnts[pathId] = count;
-            }
-        }
 
-        // process last function
-        if (!funcName.empty()) {
+        std::vector<PathCost> pathCosts;
+        forEachFunction(stream, [&](std::string const& funcName, std::unordered_map<uint64_t, uint64_t>&& pathCnts) {
             fs::path filePath(prof);
             filePath.replace_filename(funcName + ".txt");
             BallLarusRegen regen(filePath, std::move(pathCnts));
             regen.output();
-        }
+            auto& costs = regen.costs();
+            pathCosts.insert(pathCosts.end(), costs.begin(), costs.end());
+        });
+        writeCostReport(dir / "path-cost.csv", pathCosts);
 
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << '\n';
@@ -218,4 +632,4 @@ int main(int argc, char* argv[]) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Run every test/*.c program with the hot path consumer linked in, from the build directory
+if [ $# -gt 1 ]; then
+    echo "Usage: $0 [pass pipeline, default ball-larus]"
+    exit 1
+fi
+
+PASSES=${1:-ball-larus}
+BUILD_DIR=$(pwd)
+TEST_DIR=$(cd "$(dirname "$0")/test" && pwd)
+
+temp_dir=$(mktemp -d)
+cd "$temp_dir"
+
+clang -c "$TEST_DIR/hot_path_consumer/consumer.c" -o consumer.o
+
+failed=0
+for c_file in "$TEST_DIR"/*.c; do
+    base_name=$(basename "$c_file" .c)
+    echo "Running $base_name..."
+
+    if ! { clang -S -emit-llvm "$c_file" -o "$base_name.ll" &&
+        opt -load-pass-plugin="$BUILD_DIR/ball_larus/BallLarusPass.so" -passes="$PASSES" "$base_name.ll" -o "instrumented_$base_name.bc" &&
+        clang "instrumented_$base_name.bc" consumer.o "$BUILD_DIR/lib/libBallLarusRuntime.so" -pthread \
+            -o "instrumented_$base_name" -Wl,-rpath,"$BUILD_DIR/lib"; }; then
+        echo "FAILED: could not build $base_name"
+        failed=1
+        continue
+    fi
+
+    if ./instrumented_$base_name > "$base_name.log"; then
+        tail -n 1 "$base_name.log"
+    else
+        cat "$base_name.log"
+        failed=1
+    fi
+done
+
+cd "$BUILD_DIR"
+rm -rf "$temp_dir"
+exit $failed
@@ -0,0 +1,80 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../ball_larus/runtime/hot_paths.h"
+
+// Linked into a test program, drains hot path events on its own thread while the program runs.
+// The threshold is read from BALL_LARUS_HOT_THRESHOLD (default 2).
+// At exit it checks the events and exits with 1 if they are wrong.
+
+#define MAX_EVENTS 4096
+
+static unsigned long threshold = 2;
+static struct ball_larus_hot_path events[MAX_EVENTS];
+static size_t numEvents = 0;
+static _Atomic int stop = 0;
+static pthread_t thread;
+
+static void drain(void) {
+    while (numEvents < MAX_EVENTS) {
+        size_t n = ball_larus_drain_hot_paths(events + numEvents, MAX_EVENTS - numEvents);
+        if (n == 0) {
+            break;
+        }
+        numEvents += n;
+    }
+}
+
+static void* consume(void* arg) {
+    struct timespec interval = {0, 1000000};   // 1 ms
+    (void)arg;
+    while (!stop) {
+        drain();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+__attribute__((constructor)) static void start(void) {
+    const char* env = getenv("BALL_LARUS_HOT_THRESHOLD");
+    if (env) {
+        threshold = strtoul(env, NULL, 10);
+    }
+    ball_larus_set_hot_threshold(threshold);
+    pthread_create(&thread, NULL, consume, NULL);
+}
+
+__attribute__((destructor)) static void finish(void) {
+    int errors = 0;
+    size_t i, j;
+    stop = 1;
+    pthread_join(thread, NULL);
+    drain();
+
+    for (i = 0; i < numEvents; i++) {
+        printf("Hot path: %s %lu (count %lu)\n", events[i].function, events[i].path, events[i].count);
+        // Each path becomes hot once, when its count reaches the threshold
+        if (events[i].count < threshold) {
+            errors++;
+        }
+        for (j = 0; j < i; j++) {
+            if (events[j].path == events[i].path && strcmp(events[j].function, events[i].function) == 0) {
+                errors++;
+            }
+        }
+    }
+
+    if (numEvents == 0 || errors != 0) {
+        printf("FAILED: %zu hot path events, %d errors, %lu dropped\n", numEvents, errors, ball_larus_dropped_hot_paths());
+        fflush(stdout);
+        _exit(1);
+    }
+    printf("Passed: %zu hot path events, %lu dropped\n", numEvents, ball_larus_dropped_hot_paths());
+}